@@ -474,6 +474,265 @@ wcp_get_thread_id(PyObject *self, PyObject *args)
     return PyLong_FromLong(tstate->thread_id);
 }
 
+/* Context labels are kept in each thread's PyThreadState dict so they die
+ * with their thread and wcp_capture_all can read every thread's label. Set
+ * and clear are METH_O / METH_NOARGS because they're called on every
+ * request. */
+static PyObject *wcp_context_key;
+
+static PyObject *
+wcp_set_context(PyObject *self, PyObject *label)
+{
+    PyObject *dict = PyThreadState_GetDict();
+    if (dict == NULL) {
+        PyErr_SetString(PyExc_Exception, "no thread state dict");
+        return NULL;
+    }
+    if (PyDict_SetItem(dict, wcp_context_key, label))
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+wcp_clear_context(PyObject *self, PyObject *unused)
+{
+    PyObject *dict = PyThreadState_GetDict();
+    if (dict == NULL) {
+        PyErr_SetString(PyExc_Exception, "no thread state dict");
+        return NULL;
+    }
+    if (PyDict_DelItem(dict, wcp_context_key)) {
+        if (!PyErr_ExceptionMatches(PyExc_KeyError))
+            return NULL;
+        PyErr_Clear();
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+wcp_get_context(PyObject *self, PyObject *unused)
+{
+    PyObject *dict = PyThreadState_GetDict();
+    PyObject *label = NULL;
+    if (dict != NULL)
+        label = PyDict_GetItem(dict, wcp_context_key);
+    if (label == NULL)
+        Py_RETURN_NONE;
+    Py_INCREF(label);
+    return label;
+}
+
+/* Buffer filled by wcp_capture_all. Reused between calls so steady-state
+ * sampling doesn't allocate. Only accessed with the GIL held. */
+static long *wcp_capture_buf;
+static size_t wcp_capture_len;
+static size_t wcp_capture_cap;
+
+static int
+wcp_capture_push(long v)
+{
+    if (wcp_capture_len == wcp_capture_cap) {
+        size_t cap = wcp_capture_cap ? wcp_capture_cap * 2 : 4096;
+        long *buf = realloc(wcp_capture_buf, cap * sizeof(*buf));
+        if (buf == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        wcp_capture_buf = buf;
+        wcp_capture_cap = cap;
+    }
+    wcp_capture_buf[wcp_capture_len++] = v;
+    return 0;
+}
+
+/* Open addressing table mapping code objects to small integer ids. Keyed on
+ * the code object's address rather than its value because code objects'
+ * hash and equality ignore co_filename and hashing co_consts on every frame
+ * would be slow. The table holds a reference to each code object so their
+ * addresses aren't reused while they have an id. Once WCP_MAX_CODES ids have
+ * been handed out the table is cleared at the start of the next
+ * wcp_capture_all, which releases the code objects and restarts ids at 0. */
+#define WCP_MAX_CODES 8192
+
+struct wcp_code_entry {
+    PyObject *code;
+    long id;
+};
+
+static struct wcp_code_entry *wcp_code_table;
+static size_t wcp_code_table_size;
+static long wcp_code_count;
+
+static size_t
+wcp_code_hash(PyObject *code)
+{
+    return ((size_t) code >> 4) * 2654435761u;
+}
+
+static int
+wcp_grow_code_table(void)
+{
+    size_t i, j;
+    size_t size = wcp_code_table_size ? wcp_code_table_size * 2 : 1024;
+    struct wcp_code_entry *table = calloc(size, sizeof(*table));
+
+    if (table == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    for (i = 0; i < wcp_code_table_size; i++) {
+        if (wcp_code_table[i].code == NULL)
+            continue;
+        j = wcp_code_hash(wcp_code_table[i].code) & (size - 1);
+        while (table[j].code)
+            j = (j + 1) & (size - 1);
+        table[j] = wcp_code_table[i];
+    }
+
+    free(wcp_code_table);
+    wcp_code_table = table;
+    wcp_code_table_size = size;
+    return 0;
+}
+
+static void
+wcp_clear_code_table(void)
+{
+    size_t i;
+
+    for (i = 0; i < wcp_code_table_size; i++) {
+        PyObject *code = wcp_code_table[i].code;
+        wcp_code_table[i].code = NULL;
+        Py_XDECREF(code);
+    }
+    wcp_code_count = 0;
+}
+
+/* Returns code's id, appending code to new_codes the first time it's seen.
+ * Returns -1 with an exception set on failure. */
+static long
+wcp_code_id(PyObject *code, PyObject *new_codes)
+{
+    size_t i, mask;
+
+    if (wcp_code_count * 2 >= wcp_code_table_size &&
+        wcp_grow_code_table())
+        return -1;
+
+    mask = wcp_code_table_size - 1;
+    for (i = wcp_code_hash(code) & mask; wcp_code_table[i].code;
+         i = (i + 1) & mask) {
+        if (wcp_code_table[i].code == code)
+            return wcp_code_table[i].id;
+    }
+
+    if (PyList_Append(new_codes, code))
+        return -1;
+
+    Py_INCREF(code);
+    wcp_code_table[i].code = code;
+    wcp_code_table[i].id = wcp_code_count++;
+    return wcp_code_table[i].id;
+}
+
+/* Replacement for sys._current_frames() for the sampler. Walks every thread
+ * except the caller and returns (samples, first_id, new_codes, contexts).
+ * samples is a string of native longs: for each thread, its id, its stack
+ * depth, and then a (code id, line number, last instruction) triple for each
+ * frame, innermost first. Stacks are cut off at the ignore code object.
+ * new_codes lists the code objects that were assigned ids during this call,
+ * in id order starting at first_id, so callers only have to resolve each code
+ * object's names once. first_id is 0 after the table has been cleared, and
+ * callers should forget ids from earlier calls that are >= first_id. contexts
+ * maps the ids of threads with a context label to their label. */
+static PyObject *
+wcp_capture_all(PyObject *self, PyObject *args)
+{
+    PyObject *ignore;
+    PyObject *new_codes;
+    PyObject *contexts;
+    PyObject *samples;
+    long first_id;
+    PyThreadState *current = PyThreadState_GET();
+    PyInterpreterState *interp;
+
+    if (!PyArg_ParseTuple(args, "O", &ignore))
+        return NULL;
+
+    new_codes = PyList_New(0);
+    if (new_codes == NULL)
+        return NULL;
+
+    contexts = PyDict_New();
+    if (contexts == NULL)
+        goto error_new_codes;
+
+    if (wcp_code_count >= WCP_MAX_CODES)
+        wcp_clear_code_table();
+    first_id = wcp_code_count;
+
+    wcp_capture_len = 0;
+    for (interp = PyInterpreterState_Head(); interp;
+         interp = PyInterpreterState_Next(interp)) {
+        PyThreadState *tstate = PyInterpreterState_ThreadHead(interp);
+        for (; tstate; tstate = PyThreadState_Next(tstate)) {
+            PyFrameObject *frame;
+            PyObject *label = NULL;
+            size_t depth_pos;
+
+            if (tstate == current || tstate->frame == NULL)
+                continue;
+
+            if (tstate->dict != NULL)
+                label = PyDict_GetItem(tstate->dict, wcp_context_key);
+            if (label != NULL) {
+                PyObject *tid = PyInt_FromLong(tstate->thread_id);
+                int r;
+                if (tid == NULL)
+                    goto error;
+                r = PyDict_SetItem(contexts, tid, label);
+                Py_DECREF(tid);
+                if (r)
+                    goto error;
+            }
+
+            if (wcp_capture_push(tstate->thread_id) || wcp_capture_push(0))
+                goto error;
+            depth_pos = wcp_capture_len - 1;
+
+            for (frame = tstate->frame; frame; frame = frame->f_back) {
+                long id;
+                if ((PyObject *) frame->f_code == ignore)
+                    break;
+                id = wcp_code_id((PyObject *) frame->f_code, new_codes);
+                if (id == -1 ||
+                    wcp_capture_push(id) ||
+                    wcp_capture_push(PyFrame_GetLineNumber(frame)) ||
+                    wcp_capture_push(frame->f_lasti))
+                    goto error;
+                wcp_capture_buf[depth_pos] += 1;
+            }
+        }
+    }
+
+    samples = PyString_FromStringAndSize((char *) wcp_capture_buf,
+                                         wcp_capture_len * sizeof(long));
+    if (samples == NULL)
+        goto error;
+
+    return Py_BuildValue("(NlNN)", samples, first_id, new_codes,
+                         contexts);
+
+error:
+    /* Ids handed out so far are lost with new_codes, so start over. */
+    wcp_clear_code_table();
+    Py_DECREF(contexts);
+error_new_codes:
+    Py_DECREF(new_codes);
+    return NULL;
+}
+
 static PyObject *
 wcp_raise_os_error(const char *fmt, ...)
 {
@@ -722,6 +981,14 @@ static PyMethodDef ProfMethods[] = {
     */
     {"setup", wcp_setup, METH_VARARGS, "Setup profiling."},
     {"get_thread_id", wcp_get_thread_id, METH_VARARGS, "Get current thread id."},
+    {"capture_all", wcp_capture_all, METH_VARARGS,
+     "Capture the stacks of all other threads."},
+    {"set_context", wcp_set_context, METH_O,
+     "Set the current thread's context label."},
+    {"clear_context", wcp_clear_context, METH_NOARGS,
+     "Clear the current thread's context label."},
+    {"get_context", wcp_get_context, METH_NOARGS,
+     "Get the current thread's context label."},
     {"test_fault_handling", wcp_test_fault_handling, METH_VARARGS, ""},
     {"get_log_level", wcp_get_log_level, METH_VARARGS, ""},
     {"set_log_level", wcp_set_log_level, METH_VARARGS, ""},
@@ -749,6 +1016,10 @@ init_wcp(void)
     if (!self)
         goto error_sigbus;
 
+    wcp_context_key = PyString_InternFromString("wcp.context");
+    if (!wcp_context_key)
+        goto error_sigbus;
+
 #define EXPORT_LOG_LEVEL(level)\
     v = PyInt_FromLong(WCP_ ##level);\
     if (!v)\
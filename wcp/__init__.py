@@ -1 +1,3 @@
 # Copyright (C) 2014  Peter Feiner
+
+from .record import set_context, clear_context
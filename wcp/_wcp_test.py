@@ -46,3 +46,99 @@ def test_get_thread_id():
     t.join()
     assert ids[0] != thread.get_ident()
     assert ids[0] == ids[1]
+
+def test_capture_all():
+    import array
+    started = threading.Event()
+    done = threading.Event()
+    def shiver_me_timbers():
+        started.set()
+        done.wait()
+    t = threading.Thread(target=shiver_me_timbers)
+    t.start()
+    started.wait()
+    try:
+        buf, first_id, new_codes, contexts = _wcp.capture_all(None)
+        codes = [None] * first_id + new_codes
+        buf, first_id, new_codes, contexts =\
+            _wcp.capture_all(shiver_me_timbers.__code__)
+        del codes[first_id:]
+        codes.extend(new_codes)
+    finally:
+        done.set()
+        t.join()
+
+    # Each code object is only reported once.
+    assert len(set(codes) - set([None])) == len(codes) - codes.count(None)
+    assert shiver_me_timbers.__code__ in codes
+
+    samples = array.array('l')
+    samples.fromstring(buf)
+    stacks = {}
+    i = 0
+    while i < len(samples):
+        tid, depth = samples[i], samples[i + 1]
+        stacks[tid] = [(codes[samples[j]], samples[j + 1], samples[j + 2])
+                       for j in range(i + 2, i + 2 + 3 * depth, 3)]
+        i += 2 + 3 * depth
+
+    # The calling thread isn't captured.
+    assert thread.get_ident() not in stacks
+    # Stack is cut off at the ignored code object.
+    names = [code.co_name for code, lineno, lasti in stacks[t.ident]]
+    assert 'wait' in names
+    assert 'shiver_me_timbers' not in names
+
+def test_capture_all_releases_codes():
+    import sys
+    # Enough distinct code objects on the stacks of a few threads to go past
+    # the limit on code ids.
+    started = threading.Semaphore(0)
+    done = threading.Event()
+    funcs = []
+    def make_chain(n):
+        f = lambda: (started.release(), done.wait())
+        for i in range(n):
+            f = eval('lambda: f()', {'f': f})
+            funcs.append(f)
+        return f
+    threads = [threading.Thread(target=make_chain(900)) for i in range(10)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        started.acquire()
+    try:
+        code = funcs[0].__code__
+        new_codes = _wcp.capture_all(None)[2]
+        assert code in new_codes
+    finally:
+        done.set()
+        for t in threads:
+            t.join()
+    del funcs[:], new_codes
+    # The table is full, so the next call starts over and releases the code
+    # objects from earlier calls.
+    refs = sys.getrefcount(code)
+    first_id = _wcp.capture_all(None)[1]
+    assert first_id == 0
+    assert sys.getrefcount(code) == refs - 1
+
+def test_context():
+    assert _wcp.get_context() is None
+    _wcp.clear_context()
+    _wcp.set_context('shiver_me_timbers')
+    assert _wcp.get_context() == 'shiver_me_timbers'
+
+    contexts = []
+    def main():
+        contexts.append(_wcp.get_context())
+        _wcp.set_context('i_be_the_calling_function')
+        contexts.append(_wcp.capture_all(None)[3])
+    t = threading.Thread(target=main)
+    t.start()
+    t.join()
+    assert contexts[0] is None
+    assert contexts[1][thread.get_ident()] == 'shiver_me_timbers'
+
+    _wcp.clear_context()
+    assert _wcp.get_context() is None
@@ -49,6 +49,24 @@ def record_main(args):
                              'Disabled by default.'),
     parser.add_argument('-n', '--no-autostart', action='store_true',
                         help='Do not start sampling; wait for signal.')
+    parser.add_argument('-r', '--flight-recorder', default=None, type=float,
+                        metavar='SECONDS',
+                        help='Keep the last SECONDS of samples in memory and '
+                             'only write them when dumped. '
+                             'Disabled by default.')
+    parser.add_argument('-D', '--dump-signal', default=None,
+                        help='Dump the flight recorder on this signal. '
+                             'Disabled by default.')
+    parser.add_argument('-T', '--stall-threshold', default=None, type=float,
+                        metavar='MS',
+                        help='Dump the flight recorder when a thread stays on '
+                             'the same stack for MS milliseconds. '
+                             'Disabled by default.')
+    parser.add_argument('-G', '--sample-gc', default=None, type=float,
+                        metavar='MS',
+                        help='Record the time and call chain of at most one '
+                             'garbage collection every MS milliseconds. '
+                             'Disabled by default.')
     opts, script_args = parser.parse_known_args(args)
     argv = [opts.script_path] + script_args
 
@@ -71,6 +89,13 @@ def record_main(args):
     record_opts.stop_signal = stop_signal
     record_opts.start_signal = start_signal
 
+    if opts.sample_gc is not None:
+        record_opts.sample_gc = opts.sample_gc / 1000
+    record_opts.flight_recorder = opts.flight_recorder
+    record_opts.dump_signal = parse_signal(opts.dump_signal)
+    if opts.stall_threshold is not None:
+        record_opts.stall_threshold = opts.stall_threshold / 1000
+
     record.record_script(argv, record_opts)
 
 def report_main(args):
@@ -79,11 +104,31 @@ def report_main(args):
                         help='Sample file. Default is wcp.data.')
     parser.add_argument('-t', '--top-down', action='store_true',
                         help='Root call chain at entry points.')
+    parser.add_argument('-c', '--context', default=None,
+                        help='Only report samples with this context label.')
+    parser.add_argument('-C', '--group-by-context', action='store_true',
+                        help='Report each context label separately.')
+    parser.add_argument('-i', '--instructions', action='store_true',
+                        help='Split lines by bytecode instruction.')
+    parser.add_argument('-m', '--metric', default='samples',
+                        choices=report.METRICS,
+                        help='What to attribute to call chains: samples, '
+                             'gc-time or allocations. Default is samples. '
+                             'allocations is the net count of container '
+                             'objects at each sampled collection: about the '
+                             'gen-0 gc threshold for automatic collections, '
+                             'and blind to containers freed in between, so it '
+                             'shows where collections are triggered, not how '
+                             'much is allocated.')
     opts = parser.parse_args(args)
 
     report_opts = report.Options()
     report_opts.data_path = opts.data_path
     report_opts.top_down = opts.top_down
+    report_opts.context = opts.context
+    report_opts.group_by_context = opts.group_by_context
+    report_opts.instructions = opts.instructions
+    report_opts.metric = opts.metric
     report.write(report_opts, sys.stdout)
 
 def main():
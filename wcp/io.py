@@ -8,17 +8,19 @@ EVENT_TYPES = {
     'SAMPLE': 0,
     'START': 1,
     'STOP': 2,
+    'GC': 3,
 }
 EVENT_NAMES = dict((v, k) for k, v in EVENT_TYPES.items())
 for k, v in EVENT_TYPES.items():
     globals()['%s_EVENT' % k] = v
 
 class Frame(object):
-    def __init__(self, filename, lineno, name, firstlineno):
+    def __init__(self, filename, lineno, name, firstlineno, lasti=None):
         self.filename = filename
         self.lineno = lineno
         self.name = name
         self.firstlineno = firstlineno
+        self.lasti = lasti
 
     def __hash__(self):
         return hash((self.filename, self.lineno))
@@ -28,8 +30,9 @@ class Frame(object):
                self.lineno == other.lineno
 
     def __repr__(self):
-        return 'Frame(%s, %s, %s, %s)' %\
-               (self.filename, self.lineno, self.name, self.firstlineno)
+        return 'Frame(%s, %s, %s, %s, %s)' %\
+               (self.filename, self.lineno, self.name, self.firstlineno,
+                self.lasti)
 
     def __str__(self):
         return '%s:%d in %s' %\
@@ -54,15 +57,26 @@ class Event(object):
                 self.data)
 
 class SampleData(object):
-    def __init__(self, frames):
+    def __init__(self, frames, context=None):
         self.frames = frames
+        self.context = context
 
     def __repr__(self):
-        return 'SampleData(%r)' % self.frames
+        return 'SampleData(%r, %r)' % (self.frames, self.context)
 
     def __str__(self):
         return '\n'.join(map(str, self.frames))
 
+class GcData(SampleData):
+    def __init__(self, duration, allocations, frames, context=None):
+        SampleData.__init__(self, frames, context)
+        self.duration = duration
+        self.allocations = allocations
+
+    def __repr__(self):
+        return 'GcData(%r, %r, %r, %r)' %\
+               (self.duration, self.allocations, self.frames, self.context)
+
 def read_frames(fp):
     frames = []
     while True:
@@ -73,8 +87,9 @@ def read_frames(fp):
         lineno = int(read_cstr(fp))
         name = read_cstr(fp)
         firstlineno = int(read_cstr(fp))
+        lasti = int(read_cstr(fp))
         read_const(fp, '\n')
-        frames.append(Frame(filename, lineno, name, firstlineno))
+        frames.append(Frame(filename, lineno, name, firstlineno, lasti))
     return frames
     
 def read_cstr(fp):
@@ -104,8 +119,18 @@ def read_header(fp):
     return Event(time_, pid, tid, event_type)
 
 def read_sample_data(fp):
+    context = read_cstr(fp)
+    read_const(fp, '\n')
     frames = read_frames(fp)
-    return SampleData(frames)
+    return SampleData(frames, context or None)
+
+def read_gc_data(fp):
+    duration = float(read_cstr(fp))
+    allocations = int(read_cstr(fp))
+    read_const(fp, '\n')
+    sample_data = read_sample_data(fp)
+    return GcData(duration, allocations, sample_data.frames,
+                  sample_data.context)
 
 class PeekableFile(object):
     def __init__(self, fp):
@@ -133,6 +158,8 @@ def read_events(fp):
             event = read_header(fp)
             if event.event_type == SAMPLE_EVENT:
                 event.data = read_sample_data(fp)
+            elif event.event_type == GC_EVENT:
+                event.data = read_gc_data(fp)
             yield event
     except IOError:
         raise
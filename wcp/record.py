@@ -19,6 +19,10 @@ class Options(object):
     stop_signal = None
     start_signal = None
     sample_greenlets = False
+    flight_recorder = None
+    dump_signal = None
+    stall_threshold = None
+    sample_gc = None
 
 def setup(options):
     record_impl.setup(options)
@@ -32,6 +36,13 @@ def start():
 def toggle():
     record_impl.toggle()
 
+def dump():
+    record_impl.dump()
+
+# Not wrapped because they're called on hot paths (e.g., every request).
+set_context = record_impl.set_context
+clear_context = record_impl.clear_context
+
 def record_script(argv, options):
     # TODO: Find script_path in $PATH.
     options.ignore = record_script.__code__
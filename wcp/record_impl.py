@@ -16,13 +16,23 @@ threading = safe_import('threading')
 time = safe_import('time')
 signal = safe_import('signal')
 
+import array
+import atexit
+import collections
 import contextlib
+import dis
 import gc
 import inspect
+import re
 import cStringIO
 
 from . import io
 
+try:
+    from . import _wcp
+except ImportError:
+    _wcp = None
+
 class State(object):
     def __init__(self):
         self.reset()
@@ -32,6 +42,12 @@ class State(object):
         self.pipe = None
         self.options = None
         self.sampling = False
+        self.ring = collections.deque()
+        self.stacks = {}
+        self.stalled_stacks = set()
+        self.pending = collections.deque()
+        self.gc_armed_time = 0
+        self.gc_armed = False
 
 state = State()
 
@@ -70,26 +86,169 @@ def write_stop():
 def write_start():
     write_start_stop_event(io.START_EVENT)
 
-def write_sample(now, pid, tid, frame):
+def format_frames(frame):
     buf = cStringIO.StringIO()
-    buf.write(event_header(now, pid, tid, io.SAMPLE_EVENT))
     while frame is not None:
         if frame.f_code == state.options.ignore:
             break
-        buf.write('%s\0%d\0%s\0%d\0\n' % 
+        buf.write('%s\0%d\0%s\0%d\0%d\0\n' % 
                   (os.path.abspath(frame.f_code.co_filename),
                    frame.f_lineno,
                    frame.f_code.co_name,
-                   frame.f_code.co_firstlineno))
+                   frame.f_code.co_firstlineno,
+                   frame.f_lasti))
         frame = frame.f_back
     buf.write('\n')
-
+    return buf.getvalue()
+
+# set_context doesn't check labels so it stays cheap; make them safe to write
+# here instead.
+def format_context(label):
+    if label is None:
+        return ''
+    if isinstance(label, unicode):
+        label = label.encode('utf-8')
+    else:
+        label = str(label)
+    return label.replace('\0', '\\0').replace('\n', '\\n')
+
+# Only the sampler thread calls this. flock doesn't serialize threads that
+# share the file description, so events from other threads are queued in
+# state.pending for write_pending.
+def write_event(now, buf):
+    if state.options.flight_recorder is not None:
+        record_sample(now, buf)
+    else:
+        with flock(state.options.out_fd):
+            safe_write(state.options.out_fd, buf)
+
+def write_pending():
+    while state.pending:
+        write_event(*state.pending.popleft())
+
+def write_sample(now, pid, tid, stack, context):
+    buf = '%s%s\0\n%s' % (event_header(now, pid, tid, io.SAMPLE_EVENT),
+                           format_context(context), stack)
+    write_event(now, buf)
+
+# Flight recorder mode: keep the last options.flight_recorder seconds of
+# samples in memory and only write them out when a dump is triggered.
+def record_sample(now, buf):
+    state.ring.append((now, buf))
+    while state.ring and state.ring[0][0] < now - state.options.flight_recorder:
+        state.ring.popleft()
+
+# Dumps look like an ordinary START, SAMPLE ..., STOP sequence covering the
+# recorder's window.
+def write_dump():
+    now = time.time()
+    pid = os.getpid()
+    if state.ring:
+        start_time = state.ring[0][0]
+    else:
+        start_time = now
+    buf = cStringIO.StringIO()
+    buf.write(event_header(start_time, pid, 0, io.START_EVENT))
+    for _, sample in state.ring:
+        buf.write(sample)
+    buf.write(event_header(now, pid, 0, io.STOP_EVENT))
+    state.ring.clear()
     with flock(state.options.out_fd):
         safe_write(state.options.out_fd, buf.getvalue())
 
+# Matches the last instruction field of each frame so stalls are detected at
+# line granularity; a thread spinning on one line is stuck too.
+LASTI_RE = re.compile('\0-?[0-9]+\0\n')
+
+# Names that a line blocked in a call into C is calling, e.g., time.sleep()
+# or the lock acquire in threading.Condition.wait, which Queue.get,
+# Event.wait and Thread.join all wait in.
+BLOCKING_CALLS = frozenset(['sleep', '_sleep', 'pause', 'select', 'poll',
+                            'accept', 'recv', 'recvfrom', 'recv_into', 'read',
+                            'readline', 'acquire', 'wait', 'join', 'sigwait',
+                            'waitpid'])
+LOAD_NAME_OPS = frozenset(dis.opmap[name]
+                          for name in ('LOAD_NAME', 'LOAD_GLOBAL', 'LOAD_ATTR'))
+
+# True when tid is idle rather than stuck: its innermost frame is on a line
+# that loads one of BLOCKING_CALLS before the current instruction. Ids that
+# aren't threads are switched-out greenlets, which are waiting by definition.
+def is_waiting(tid):
+    frame = sys._current_frames().get(tid)
+    if frame is None:
+        return True
+    code = frame.f_code
+    co_code = code.co_code
+    i = 0
+    for offset, lineno in dis.findlinestarts(code):
+        if offset > frame.f_lasti:
+            break
+        i = offset
+    while i < frame.f_lasti:
+        op = ord(co_code[i])
+        if op < dis.HAVE_ARGUMENT:
+            i += 1
+            continue
+        arg = ord(co_code[i + 1]) + ord(co_code[i + 2]) * 256
+        if op in LOAD_NAME_OPS and arg < len(code.co_names) and\
+           code.co_names[arg] in BLOCKING_CALLS:
+            return True
+        i += 3
+    return False
+
+# True when tid has just spent options.stall_threshold seconds on the same
+# stack and isn't waiting. Fires at most once per stack, so threads going back
+# and forth between work and the same stuck spot don't keep dumping.
+def check_stall(now, tid, stack):
+    stack = LASTI_RE.sub('\0\n', stack)
+    try:
+        last_stack, since, fired = state.stacks[tid]
+    except KeyError:
+        last_stack = None
+    if last_stack != stack:
+        state.stacks[tid] = (stack, now, False)
+        return False
+    if fired or now - since < state.options.stall_threshold:
+        return False
+    state.stacks[tid] = (stack, since, True)
+    if stack in state.stalled_stacks or is_waiting(tid):
+        return False
+    state.stalled_stacks.add(stack)
+    return True
+
 orig_greenlet = None
 all_greenlets = None
 greenlet_lock = threading.Lock()
+greenlet_tracing = threading.local()
+
+# The running greenlet's context label is kept with its thread, where
+# thread_stacks finds it. On each switch, move the label of the greenlet being
+# switched away from onto the greenlet object, where greenlet_frames finds it,
+# and restore the label of the greenlet being switched to.
+def switch_context(event, args):
+    if event in ('switch', 'throw'):
+        origin, target = args
+        label = get_context()
+        if label is None:
+            origin.__dict__.pop(CONTEXT_ATTR, None)
+        else:
+            setattr(origin, CONTEXT_ATTR, label)
+        label = getattr(target, CONTEXT_ATTR, None)
+        if label is None:
+            clear_context()
+        else:
+            set_context(label)
+    previous = greenlet_tracing.previous
+    if previous is not None:
+        previous(event, args)
+
+# greenlet.settrace is per thread, so it's installed in each thread that
+# creates greenlets.
+def trace_greenlet_switches():
+    if not getattr(greenlet_tracing, 'installed', False):
+        import greenlet
+        greenlet_tracing.previous = greenlet.settrace(switch_context)
+        greenlet_tracing.installed = True
 
 def hijack_greenlet():
     global orig_greenlet
@@ -105,6 +264,7 @@ def hijack_greenlet():
         class Greenlet(orig_greenlet):
             def __init__(self, *args, **kwargs):
                 orig_greenlet.__init__(self, *args, **kwargs)
+                trace_greenlet_switches()
                 with greenlet_lock:
                     all_greenlets.add(self)
 
@@ -115,39 +275,218 @@ def hijack_greenlet():
                     all_greenlets.add(o)
             orig_greenlet = greenlet.greenlet
             greenlet.greenlet = Greenlet
+        trace_greenlet_switches()
     except:
         orig_greenlet = None
         raise
 
-def frames():
-    for tid, frame in sys._current_frames().iteritems():
-        yield tid, frame
-    if state.options.sample_greenlets:
+# Python 2 has no gc callbacks or allocator hooks. However, with
+# gc.DEBUG_STATS set, a collection writes a few lines to sys.stderr from the
+# thread that triggered it before and after collecting, so a stand-in stderr
+# can time collections and attribute them to the allocating call chain. Each
+# event also records gc.get_count()[0], the net number of container objects
+# allocated since the last collection. For automatic collections that's
+# always about gc.get_threshold()[0], and containers freed before the
+# collection don't show up at all, so it only says where collections were
+# triggered, not how much was allocated.
+#
+# DEBUG_STATS makes every collection count the objects in all generations, so
+# it's only armed for one collection at a time: the sampler thread arms it at
+# most every options.sample_gc seconds and the monitor disarms it once the
+# collection is recorded. If the program set DEBUG_STATS itself, the flag and
+# gc's output are left alone.
+
+# Matches each generation's count on the 'gc: objects in each generation:'
+# line, which is printed one count per write.
+GC_COUNTS_RE = re.compile(' [0-9]+$')
+
+# Stands in for sys.stderr to see the lines gc.DEBUG_STATS prints around a
+# collection:
+#
+#   gc: collecting generation 0...
+#   gc: objects in each generation: 12 0 3456
+#   ...
+#   gc: done, 2 unreachable, 0 uncollectable, 0.0001s elapsed.
+#
+# Only those lines are consumed; anything else, such as output from
+# finalizers and weakref callbacks run during the collection, goes to the real
+# stream.
+class GcMonitor(object):
+    def __init__(self, stream):
+        self.stream = stream
+        self.tid = None
+        self.phase = None
+        self.start_time = None
+        self.allocations = None
+
+    def write(self, s):
+        if self.tid is None:
+            if not state.gc_armed:
+                return self.stream.write(s)
+            if s.startswith('gc: collecting generation'):
+                self.tid = get_ident()
+                self.phase = 'collecting'
+                self.allocations = gc.get_count()[0]
+                self.start_time = time.time()
+                return
+            if not s.startswith('gc: done'):
+                return self.stream.write(s)
+            # Armed partway through a collection. Swallow its end but leave
+            # the flag armed for the next one.
+            self.tid = get_ident()
+            self.start_time = None
+            self.phase = 'done'
+        if self.tid != get_ident():
+            return self.stream.write(s)
+        if self.phase == 'collecting' and\
+           s.startswith('gc: objects in each generation:'):
+            self.phase = 'counts'
+        elif self.phase == 'counts' and GC_COUNTS_RE.match(s):
+            pass
+        elif self.phase == 'counts' and s == '\n':
+            self.phase = 'running'
+        elif self.phase == 'running' and s.startswith('gc: done'):
+            self.phase = 'done'
+        elif self.phase != 'done':
+            return self.stream.write(s)
+        if self.phase == 'done' and s.endswith('\n'):
+            self.tid = None
+            self.phase = None
+            if self.start_time is None:
+                return
+            disarm_gc()
+            gc_collected(time.time() - self.start_time, self.allocations,
+                         sys._getframe(1))
+
+    def __getattr__(self, name):
+        return getattr(self.stream, name)
+
+gc_monitor = None
+
+def hijack_gc():
+    global gc_monitor
+    if not isinstance(sys.stderr, GcMonitor):
+        sys.stderr = GcMonitor(sys.stderr)
+        # Stop before interpreter teardown clears our module's globals.
+        atexit.register(disarm_gc)
+    gc_monitor = sys.stderr
+
+def arm_gc(now):
+    global gc_monitor
+    if sys.stderr is not gc_monitor:
+        # The program replaced sys.stderr, so gc's output would go to its
+        # stream instead of the monitor. Stop sampling collections.
+        if gc_monitor is not None:
+            gc_monitor = None
+            disarm_gc()
+        return
+    if now - state.gc_armed_time >= state.options.sample_gc:
+        debug = gc.get_debug()
+        if debug & gc.DEBUG_STATS:
+            return
+        state.gc_armed_time = now
+        state.gc_armed = True
+        gc.set_debug(debug | gc.DEBUG_STATS)
+
+def disarm_gc():
+    if state.gc_armed:
+        state.gc_armed = False
+        gc.set_debug(gc.get_debug() & ~gc.DEBUG_STATS)
+
+# Called in the collecting thread, so the event is left for the sampler thread
+# to write.
+def gc_collected(duration, allocations, frame):
+    tid = get_ident()
+    if not state.sampling or tid == state.thread.ident:
+        return
+    now = time.time()
+    buf = '%s%f\0%d\0\n%s\0\n%s' %\
+          (event_header(now, os.getpid(), tid, io.GC_EVENT),
+           duration, allocations, format_context(get_context()),
+           format_frames(frame))
+    state.pending.append((now, buf))
+
+# Format strings for the frames of each code object seen by
+# _wcp.capture_all, indexed by code id. Only the line number is left to fill
+# in along with the last instruction.
+code_formats = []
+
+def code_format(code):
+    return '%s\0%%d\0%s\0%d\0%%d\0\n' %\
+           (os.path.abspath(code.co_filename).replace('%', '%%'),
+            code.co_name.replace('%', '%%'),
+            code.co_firstlineno)
+
+def thread_stacks():
+    if _wcp is None:
+        current_tid = threading.current_thread().ident
+        for tid, frame in sys._current_frames().iteritems():
+            if tid != current_tid:
+                thread = threading._active.get(tid)
+                yield tid, format_frames(frame),\
+                      getattr(thread, CONTEXT_ATTR, None)
+        return
+
+    buf, first_id, new_codes, contexts =\
+        _wcp.capture_all(state.options.ignore)
+    del code_formats[first_id:]
+    code_formats.extend(map(code_format, new_codes))
+    samples = array.array('l')
+    samples.fromstring(buf)
+    i = 0
+    while i < len(samples):
+        tid = samples[i]
+        end = i + 2 + 3 * samples[i + 1]
+        lines = [code_formats[samples[j]] % (samples[j + 1], samples[j + 2])
+                 for j in xrange(i + 2, end, 3)]
+        lines.append('\n')
+        yield tid, ''.join(lines), contexts.get(tid)
+        i = end
+
+def greenlet_frames():
+    with greenlet_lock:
+        all_greenlets_copy = set(all_greenlets)
+    dead_greenlets = set()
+    try:
+        for gt in all_greenlets:
+            if gt.dead:
+                dead_greenlets.add(gt)
+            elif gt.gr_frame is not None:
+                yield id(gt), gt.gr_frame, getattr(gt, CONTEXT_ATTR, None)
+    finally:
         with greenlet_lock:
-            all_greenlets_copy = set(all_greenlets)
-        dead_greenlets = set()
-        try:
-            for gt in all_greenlets:
-                if gt.dead:
-                    dead_greenlets.add(gt)
-                elif gt.gr_frame is not None:
-                    yield id(gt), gt.gr_frame
-        finally:
-            with greenlet_lock:
-                all_greenlets.difference_update(dead_greenlets)
+            all_greenlets.difference_update(dead_greenlets)
+
+def stacks():
+    for tid, stack, context in thread_stacks():
+        yield tid, stack, context
+    if state.options.sample_greenlets:
+        for tid, frame, context in greenlet_frames():
+            yield tid, format_frames(frame), context
 
 def collect_sample():
     now = time.time()
     pid = os.getpid()
-    current_tid = threading.current_thread().ident
-    for tid, frame in frames():
-        if tid != current_tid:
-            write_sample(now, pid, tid, frame)
+    stalled = False
+    seen = set()
+    write_pending()
+    if state.options.sample_gc is not None:
+        arm_gc(now)
+    for tid, stack, context in stacks():
+        write_sample(now, pid, tid, stack, context)
+        if state.options.stall_threshold is not None:
+            seen.add(tid)
+            stalled = check_stall(now, tid, stack) or stalled
+    for tid in set(state.stacks) - seen:
+        del state.stacks[tid]
+    if stalled:
+        write_dump()
 
 def main_loop():
     period = float(1) / state.options.frequency
     last_sample_time = time.time() - period
-    if state.sampling:
+    flight_recorder = state.options.flight_recorder is not None
+    if state.sampling and not flight_recorder:
         write_start()
     while True:
         if state.sampling:
@@ -158,11 +497,17 @@ def main_loop():
         ready = select.select([state.pipe[0]], [], [], timeout)
         if ready[0]:
             msg = os.read(state.pipe[0], 1)
-            if msg in (START_MSG, TOGGLE_MSG) and not state.sampling:
-                write_start()
+            if msg == DUMP_MSG:
+                if flight_recorder:
+                    write_dump()
+            elif msg in (START_MSG, TOGGLE_MSG) and not state.sampling:
+                if not flight_recorder:
+                    write_start()
                 state.sampling = True
             elif msg in (STOP_MSG, TOGGLE_MSG) and state.sampling:
-                write_stop()
+                write_pending()
+                if not flight_recorder:
+                    write_stop()
                 state.sampling = False
             else:
                 raise Exception('Unknown message %r' % msg)
@@ -178,12 +523,41 @@ def main_loop():
         else:
             timeout = period - time_since_last_sample
 
+get_ident = threading._get_ident
+
+# Context labels live in per-thread state so they die with their thread: the
+# thread state dict when _wcp is built, otherwise the threading.Thread object.
+# When sampling greenlets, switch_context moves them along with the running
+# greenlet. Setting a label is cheap enough to do on every request.
+CONTEXT_ATTR = '_wcp_context'
+
+def set_context(label):
+    if _wcp is not None:
+        _wcp.set_context(label)
+    else:
+        setattr(threading.current_thread(), CONTEXT_ATTR, label)
+
+def clear_context():
+    if _wcp is not None:
+        _wcp.clear_context()
+    else:
+        threading.current_thread().__dict__.pop(CONTEXT_ATTR, None)
+
+def get_context():
+    if _wcp is not None:
+        return _wcp.get_context()
+    else:
+        return getattr(threading.current_thread(), CONTEXT_ATTR, None)
+
 orig_os_fork = os.fork
 def fork():
     r, w = os.pipe()
     pid = orig_os_fork()
     if pid == 0:
         os.close(r)
+        # The parent's sampler armed this; the child's sampler, if any, will
+        # re-arm it.
+        disarm_gc()
         if threading.current_thread() == state.thread:
             # Forking from our own thread. We could handle this enough to let an
             # exec() happen before returning to the sampling loop.
@@ -210,9 +584,18 @@ def setup(options):
     if state.thread is not None:
         raise Exception('Profiling already started')
 
+    if options.flight_recorder is None:
+        if options.dump_signal is not None:
+            raise Exception('Dump signal requires flight recorder.')
+        if options.stall_threshold is not None:
+            raise Exception('Stall threshold requires flight recorder.')
+
     if options.sample_greenlets:
         hijack_greenlet()
 
+    if options.sample_gc is not None:
+        hijack_gc()
+
     os.fork = fork
     state.options = options
     state.pipe = os.pipe()
@@ -230,6 +613,7 @@ def setup(options):
     else:
         setup_handler(options.start_signal, start)
         setup_handler(options.stop_signal, stop)
+    setup_handler(options.dump_signal, dump)
 
     # Start thread after signal handlers are setup so tests can safely send
     # signals as soon as the first event is emitted.
@@ -241,6 +625,7 @@ START_MSG = 's'
 STOP_MSG = 'S'
 TOGGLE_MSG = 't'
 DETACH_MSG = 'd'
+DUMP_MSG = 'D'
 
 def start():
     os.write(state.pipe[1], START_MSG)
@@ -250,3 +635,6 @@ def stop():
 
 def toggle():
     os.write(state.pipe[1], TOGGLE_MSG)
+
+def dump():
+    os.write(state.pipe[1], DUMP_MSG)
@@ -9,6 +9,7 @@ import time
 
 import wcp.io as io
 import wcp.record as record
+import wcp.record_impl
 
 class Runnee(object):
 
@@ -124,6 +125,8 @@ def test_wait_for_sample(runner):
     assert e2.time > e1.time
     assert isinstance(e2.data, io.SampleData)
     assert 'test_wait_for_sample' in str(e2.data.frames)
+    for frame in e2.data.frames:
+        assert frame.lasti >= 0
     r.drain_kill_and_wait(signal.SIGTERM)
 
 def test_follow_fork(runner):
@@ -239,6 +242,263 @@ while True:
     assert r.read_event() == None
     r.wait(exit_signal=signal.SIGTERM)
 
+def test_context(runner):
+    r = runner.run('''\
+import signal
+wcp.set_context('shiver_me_timbers')
+signal.pause()''')
+    r.read_start_event()
+    e = r.read_sample_event()
+    assert e.data.context == 'shiver_me_timbers'
+    r.drain_kill_and_wait(signal.SIGTERM)
+
+    r = runner.run('''\
+import signal
+wcp.set_context('shiver_me_timbers')
+wcp.clear_context()
+signal.pause()''')
+    r.read_start_event()
+    e = r.read_sample_event()
+    assert e.data.context is None
+    r.drain_kill_and_wait(signal.SIGTERM)
+
+def test_sample_gc(runner):
+    runner.options.sample_gc = 0
+    r = runner.run('''\
+def shiver_me_timbers():
+    while True:
+        x = [[] for i in range(1000)]
+shiver_me_timbers()''')
+    r.read_start_event()
+    for e in r.read_events():
+        if e.event_type == io.GC_EVENT:
+            break
+    else:
+        assert False, 'No gc event'
+    assert e.tid != 0
+    assert e.data.duration >= 0
+    assert e.data.allocations > 0
+    assert 'shiver_me_timbers' in str(e.data.frames)
+    r.drain_kill_and_wait(signal.SIGTERM)
+
+def test_sample_gc_passes_output_through(runner):
+    runner.options.sample_gc = 0
+    r = runner.run('''\
+def shiver_me_timbers():
+    import cStringIO
+    import gc
+    import sys
+    import time
+    import weakref
+    class Cycle(object):
+        pass
+    out = cStringIO.StringIO()
+    sys.stderr.stream = out
+    refs = []
+    for i in range(100):
+        c = Cycle()
+        c.c = c
+        refs.append(weakref.ref(c, lambda r: sys.stderr.write('callback\\n')))
+        del c
+        gc.collect()
+        time.sleep(0.01)
+    sys.stderr.stream = sys.__stderr__
+    assert out.getvalue() == 'callback\\n' * 100, repr(out.getvalue())
+shiver_me_timbers()''')
+    r.read_start_event()
+    gc_events = [e for e in r.read_events() if e.event_type == io.GC_EVENT]
+    r.wait(exit_code=0)
+    assert 'shiver_me_timbers' in str(gc_events[0].data.frames)
+
+def test_sample_gc_program_debug_stats(runner):
+    runner.options.sample_gc = 0
+    r = runner.run('''\
+def shiver_me_timbers():
+    import cStringIO
+    import gc
+    import sys
+    import time
+    gc.set_debug(gc.DEBUG_STATS)
+    out = cStringIO.StringIO()
+    sys.stderr.stream = out
+    for i in range(100):
+        gc.collect()
+        time.sleep(0.01)
+    sys.stderr.stream = sys.__stderr__
+    assert gc.get_debug() & gc.DEBUG_STATS
+    # The program's own stats all come through.
+    assert out.getvalue().count('gc: collecting generation') >= 100
+    assert out.getvalue().count('gc: done') ==\\
+           out.getvalue().count('gc: collecting generation')
+shiver_me_timbers()''')
+    r.read_start_event()
+    for e in r.read_events():
+        pass
+    r.wait(exit_code=0)
+
+def test_sample_gc_stderr_replaced(runner):
+    runner.options.sample_gc = 0
+    r = runner.run('''\
+def shiver_me_timbers():
+    import cStringIO
+    import gc
+    import sys
+    import time
+    out = cStringIO.StringIO()
+    sys.stderr = out
+    # Give the sampler a chance to notice.
+    time.sleep(0.5)
+    out.truncate(0)
+    for i in range(100):
+        x = [[] for i in range(1000)]
+        time.sleep(0.01)
+    sys.stderr = sys.__stderr__
+    assert not gc.get_debug() & gc.DEBUG_STATS
+    assert out.getvalue() == '', repr(out.getvalue())
+shiver_me_timbers()''')
+    r.read_start_event()
+    for e in r.read_events():
+        pass
+    r.wait(exit_code=0)
+
+def test_context_unicode(runner):
+    r = runner.run('''\
+import signal
+wcp.set_context(u'caf\\xe9\\n\\0')
+signal.pause()''')
+    r.read_start_event()
+    e = r.read_sample_event()
+    assert e.data.context == 'caf\xc3\xa9\\n\\0'
+    # The sampler is still alive.
+    e = r.read_sample_event()
+    assert e.data.context == 'caf\xc3\xa9\\n\\0'
+    r.drain_kill_and_wait(signal.SIGTERM)
+
+def test_context_dies_with_thread(runner):
+    r = runner.run('''\
+import signal
+import threading
+def labelled():
+    import wcp
+    wcp.set_context('shiver_me_timbers')
+    assert wcp.record_impl.get_context() == 'shiver_me_timbers'
+t = threading.Thread(target=labelled)
+t.start()
+t.join()
+def i_be_the_new_thread():
+    import time
+    time.sleep(10)
+t = threading.Thread(target=i_be_the_new_thread)
+t.daemon = True
+t.start()
+signal.pause()''')
+    r.read_start_event()
+    for e in r.read_events():
+        if 'i_be_the_new_thread' in str(e.data.frames):
+            break
+    else:
+        assert False, 'No sample of new thread'
+    assert e.data.context is None
+    r.drain_kill_and_wait(signal.SIGTERM)
+
+def test_flight_recorder_dump_signal(runner):
+    runner.options.flight_recorder = 0.5
+    runner.options.dump_signal = signal.SIGUSR2
+    pipe = os.pipe()
+    r = runner.run('''\
+import os
+import signal
+os.write(%d, 'x')
+while True:
+    signal.pause()''' % pipe[1])
+    # Setup is done once the child writes to the pipe.
+    os.read(pipe[0], 1)
+    time.sleep(1.5)
+    r.kill(signal.SIGUSR2)
+    start = r.read_start_event()
+    samples = []
+    for e in r.read_events():
+        if e.event_type == io.STOP_EVENT:
+            break
+        assert e.event_type == io.SAMPLE_EVENT
+        samples.append(e)
+    else:
+        assert False, 'No stop event'
+    assert samples
+    assert start.time == samples[0].time
+    # Only the last 0.5s worth of samples are kept.
+    assert e.time - samples[0].time < 0.5 + 0.2
+    r.drain_kill_and_wait(signal.SIGTERM)
+
+def test_flight_recorder_stall(runner):
+    runner.options.flight_recorder = 10
+    runner.options.stall_threshold = 0.3
+    r = runner.run('''\
+def shiver_me_timbers():
+    while True:
+        pass
+shiver_me_timbers()''')
+    r.read_start_event()
+    e = r.read_sample_event()
+    assert 'shiver_me_timbers' in str(e.data.frames)
+    r.drain_kill_and_wait(signal.SIGTERM)
+
+def test_flight_recorder_idle_worker(runner):
+    import select
+    runner.options.flight_recorder = 10
+    runner.options.stall_threshold = 0.3
+    r = runner.run('''\
+def main():
+    import Queue
+    import signal
+    import threading
+    import time
+    q = Queue.Queue()
+    def worker():
+        while True:
+            end = time.time() + q.get()
+            while time.time() < end:
+                pass
+    t = threading.Thread(target=worker)
+    t.daemon = True
+    t.start()
+    for i in range(5):
+        q.put(0.1)
+        time.sleep(0.2)
+    signal.pause()
+main()''')
+    # Nothing is stuck, so nothing is dumped.
+    assert select.select([r.read_fp], [], [], 2) == ([], [], [])
+    r.drain_kill_and_wait(signal.SIGTERM)
+
+def test_check_stall():
+    import thread
+    state = wcp.record_impl.state
+    state.reset()
+    state.options = record.Options()
+    state.options.stall_threshold = 1
+    tid = thread.get_ident()
+    try:
+        check_stall = wcp.record_impl.check_stall
+        assert not check_stall(0, tid, 'shiver')
+        assert check_stall(1, tid, 'shiver')
+        assert not check_stall(2, tid, 'shiver')
+        assert not check_stall(3, tid, 'timbers')
+        assert check_stall(4, tid, 'timbers')
+        # A stack only fires once, even after the thread comes back to it.
+        assert not check_stall(5, tid, 'shiver')
+        assert not check_stall(6, tid, 'shiver')
+        # Ids that aren't threads are switched-out greenlets.
+        assert not check_stall(0, -1, 'me')
+        assert not check_stall(1, -1, 'me')
+    finally:
+        state.reset()
+
+def test_flight_recorder_options():
+    options = record.Options()
+    options.dump_signal = signal.SIGUSR2
+    pytest.raises(Exception, wcp.record_impl.setup, options)
+
 def test_toggle_signal():
     pass
 
@@ -248,6 +508,41 @@ def test_threads():
 def test_greenlets():
     pass
 
+def test_greenlets_context(runner):
+    pytest.importorskip('greenlet')
+    runner.options.sample_greenlets = True
+    r = runner.run('''\
+def i_be_main():
+    import greenlet
+    import wcp
+    def shiver_me_timbers():
+        wcp.set_context('shiver_me_timbers')
+        greenlet.getcurrent().parent.switch()
+    wcp.set_context('i_be_main')
+    g = greenlet.greenlet(shiver_me_timbers)
+    g.switch()
+    assert wcp.get_context() == 'i_be_main'
+    while True:
+        pass
+i_be_main()''')
+    r.read_start_event()
+    seen = set()
+    for e in r.read_events():
+        frames = str(e.data.frames)
+        # The paused greenlet's stack includes the frame that started it.
+        if 'shiver_me_timbers' in frames:
+            assert e.data.context == 'shiver_me_timbers'
+            seen.add(e.data.context)
+        elif 'i_be_main' in frames:
+            # The running greenlet's stack comes from its thread.
+            assert e.data.context == 'i_be_main'
+            seen.add(e.data.context)
+        if len(seen) == 2:
+            break
+    else:
+        assert False, 'No samples of both greenlets'
+    r.drain_kill_and_wait(signal.SIGTERM)
+
 def test_existing_greenlet():
     pass
 
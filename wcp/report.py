@@ -1,19 +1,144 @@
 # Copyright (C) 2014  Peter Feiner
 
 import collections
+import dis
+import inspect
 import os
 
 from . import io
 
+METRICS = ['samples', 'gc-time', 'allocations']
+
 class Options(object):
     data_path = None
+    top_down = False
+    context = None
+    group_by_context = False
+    instructions = False
+    metric = 'samples'
+
+class InstructionFrame(io.Frame):
+    def __hash__(self):
+        return hash((self.filename, self.lineno, self.lasti))
+
+    def __eq__(self, other):
+        return self.filename == other.filename and\
+               self.lineno == other.lineno and\
+               self.lasti == other.lasti
+
+    def __str__(self):
+        return '%s:%d@%d in %s' %\
+               (self.filename, self.lineno, self.lasti, self.name)
+
+    def instruction(self):
+        code = find_code(self.filename, self.name, self.firstlineno,
+                         self.lineno, self.lasti)
+        if code is None:
+            return None
+        return disassemble(code, self.lasti)
+
+def instruction_frames(frames):
+    return [InstructionFrame(f.filename, f.lineno, f.name, f.firstlineno,
+                             f.lasti) for f in frames]
+
+code_cache = {}
+compiled_files = set()
+
+def compile_codes(filename):
+    try:
+        codes = [compile(open(filename).read(), filename, 'exec')]
+    except (IOError, SyntaxError):
+        codes = []
+    while codes:
+        code = codes.pop()
+        key = (filename, code.co_name, code.co_firstlineno)
+        code_cache.setdefault(key, []).append(code)
+        codes.extend(c for c in code.co_consts if inspect.iscode(c))
+
+# Recompiles filename to find the code object that was sampled. Name and first
+# line don't identify a code object on their own (e.g., two lambdas on one
+# line), so candidates are checked against the sampled line and instruction.
+# Returns None unless exactly one candidate fits, which also catches most
+# changes to the source since the sample was taken.
+def find_code(filename, name, firstlineno, lineno, lasti):
+    if filename not in compiled_files:
+        compiled_files.add(filename)
+        compile_codes(filename)
+    matches = [code
+               for code in code_cache.get((filename, name, firstlineno), [])
+               if offset_lineno(code, lasti) == lineno]
+    if len(matches) != 1:
+        return None
+    return matches[0]
+
+decode_cache = {}
+
+# Returns {offset: (opcode, arg, next offset)} for each instruction in code.
+# EXTENDED_ARG prefixes are folded into the instruction they extend, which is
+# listed at the prefix's offset because that's where f_lasti points.
+def decode(code):
+    try:
+        return decode_cache[code]
+    except KeyError:
+        pass
+    instructions = {}
+    co_code = code.co_code
+    i = 0
+    while i < len(co_code):
+        offset = i
+        extended_arg = 0
+        op = ord(co_code[i])
+        while op == dis.EXTENDED_ARG and i + 3 < len(co_code):
+            extended_arg = (extended_arg + ord(co_code[i + 1]) +
+                            ord(co_code[i + 2]) * 256) * 65536
+            i += 3
+            op = ord(co_code[i])
+        arg = None
+        i += 1
+        if op >= dis.HAVE_ARGUMENT:
+            arg = ord(co_code[i]) + ord(co_code[i + 1]) * 256 + extended_arg
+            i += 2
+        instructions[offset] = (op, arg, i)
+    decode_cache[code] = instructions
+    return instructions
+
+# Returns the line number of the instruction at offset, or None if no
+# instruction starts there.
+def offset_lineno(code, offset):
+    if offset not in decode(code):
+        return None
+    lineno = None
+    for start, line in dis.findlinestarts(code):
+        if start > offset:
+            break
+        lineno = line
+    return lineno
+
+def disassemble(code, offset):
+    op, arg, next_offset = decode(code)[offset]
+    name = dis.opname[op]
+    if arg is None:
+        return name
+    if op in dis.hasconst:
+        arg = repr(code.co_consts[arg])
+    elif op in dis.hasname:
+        arg = code.co_names[arg]
+    elif op in dis.haslocal:
+        arg = code.co_varnames[arg]
+    elif op in dis.hascompare:
+        arg = dis.cmp_op[arg]
+    elif op in dis.hasfree:
+        arg = (code.co_cellvars + code.co_freevars)[arg]
+    elif op in dis.hasjrel:
+        arg = 'to %d' % (next_offset + arg)
+    return '%s %s' % (name, arg)
 
 class Trie(object):
     def __init__(self):
         self.children = {}
         self.count = 0
 
-    def add_path(self, values, reverse=False):
+    def add_path(self, values, reverse=False, weight=1):
         if len(values) == 0:
             return
         if reverse:
@@ -25,11 +150,11 @@ class Trie(object):
         except KeyError:
             child = Trie()
             self.children[values[i]] = child
-        child.count += 1
+        child.count += weight
         if reverse:
-            child.add_path(values[:-1])
+            child.add_path(values[:-1], weight=weight)
         else:
-            child.add_path(values[1:])
+            child.add_path(values[1:], weight=weight)
 
     def child_count(self):
         return sum([child.count for child in self.children.values()])
@@ -70,6 +195,7 @@ def write_call_chains(out, root, prefix):
         code = open(frame.filename).readlines()[frame.lineno - 1].strip()
         out.write('%s%s\n' % (prefix, frame))
         out.write('%s>> %s\n' % (prefix, code))
+        write_instruction(out, prefix, frame)
         if root == None:
             return
 
@@ -79,7 +205,7 @@ def write_call_chains(out, root, prefix):
     i = 0
     for frame, node in sorted_frames:
         i += 1
-        percent = node.count * 100 / total
+        percent = node.count * 100 / total if total else 0
         out.write('%s|\n' % prefix)
         out.write('%s|-%2d%% %s\n' % (prefix, percent, frame))
         if len(node.children) == 1:
@@ -93,15 +219,61 @@ def write_call_chains(out, root, prefix):
             code_prefix = child_prefix + '| '
         code = open(frame.filename).readlines()[frame.lineno - 1].strip()
         out.write('%s>> %s\n' % (code_prefix, code))
+        write_instruction(out, code_prefix, frame)
         write_call_chains(out, node, child_prefix)
 
+def write_instruction(out, prefix, frame):
+    if not isinstance(frame, InstructionFrame):
+        return
+    instruction = frame.instruction()
+    if instruction is not None:
+        out.write('%s>>> %d %s\n' % (prefix, frame.lasti, instruction))
+
+def event_weight(options, event):
+    if options.metric == 'samples' and event.event_type == io.SAMPLE_EVENT:
+        return 1
+    if options.metric == 'gc-time' and event.event_type == io.GC_EVENT:
+        return event.data.duration
+    if options.metric == 'allocations' and event.event_type == io.GC_EVENT:
+        return event.data.allocations
+    return None
+
+# GC events are sampled, so their totals only count recorded collections. The
+# allocations metric is the net container count at each of those collections,
+# not a count of allocations.
+def format_total(options, total):
+    if options.metric == 'gc-time':
+        return '%.3fs in sampled gc' % total
+    if options.metric == 'allocations':
+        return '%d net container allocations at sampled collections' % total
+    return '%d %s' % (total, options.metric)
+
 def write(options, out):
     fp = open(options.data_path)
-    call_chains = Trie()
-    sample_count = 0
+    call_chains = collections.defaultdict(Trie)
+    totals = collections.defaultdict(int)
     for event in io.read_events(fp):
-        if event.event_type == io.SAMPLE_EVENT: 
-            sample_count += 1
-            call_chains.add_path(event.data.frames, options.top_down)
-    out.write('%d samples\n' % sample_count)
-    write_call_chains(out, call_chains, '')
+        weight = event_weight(options, event)
+        if weight is not None:
+            context = event.data.context
+            if options.context is not None and context != options.context:
+                continue
+            if not options.group_by_context:
+                context = options.context
+            frames = event.data.frames
+            if options.instructions:
+                frames = instruction_frames(frames)
+            totals[context] += weight
+            call_chains[context].add_path(frames, options.top_down, weight)
+    if not options.group_by_context:
+        out.write('%s\n' % format_total(options, totals[options.context]))
+        write_call_chains(out, call_chains[options.context], '')
+        return
+    contexts = totals.keys()
+    contexts.sort(key=lambda x: -totals[x])
+    for context in contexts:
+        out.write('context %s: %s\n' %
+                  (context if context is not None else '<none>',
+                   format_total(options, totals[context])))
+        write_call_chains(out, call_chains[context], '')
+        out.write('\n')
@@ -0,0 +1,137 @@
+# Copyright (C) 2014  Peter Feiner
+
+import cStringIO
+import dis
+import os
+import pytest
+import tempfile
+
+import wcp.io as io
+import wcp.record_impl as record_impl
+import wcp.report as report
+
+class Sources(object):
+    def __init__(self):
+        self.paths = []
+
+    def write(self, source, suffix='.py'):
+        fd, path = tempfile.mkstemp(suffix=suffix)
+        with os.fdopen(fd, 'w') as f:
+            f.write(source)
+        self.paths.append(path)
+        return path
+
+    def cleanup(self):
+        for path in self.paths:
+            os.unlink(path)
+
+@pytest.fixture
+def sources(request):
+    s = Sources()
+    request.addfinalizer(s.cleanup)
+    return s
+
+def load(path):
+    env = {}
+    exec(compile(open(path).read(), path, 'exec'), env)
+    return env
+
+def test_find_code_lambdas_on_one_line(sources):
+    path = sources.write('f = lambda x: x.y; g = lambda: 2\n')
+    f = load(path)['f'].__code__
+    # Only f has an instruction at offset 6.
+    assert report.find_code(path, '<lambda>', 1, 1, 6) == f
+    assert report.disassemble(f, 6) == 'RETURN_VALUE'
+    # Both lambdas start with an instruction on line 1.
+    assert report.find_code(path, '<lambda>', 1, 1, 0) is None
+
+def test_find_code_changed_source(sources):
+    path = sources.write('def f():\n    return 1\n')
+    code = load(path)['f'].__code__
+    assert report.find_code(path, 'f', 1, 2, 0) == code
+    # The sampled line doesn't match the instruction.
+    assert report.find_code(path, 'f', 1, 3, 0) is None
+    # No instruction starts at the sampled offset.
+    assert report.find_code(path, 'f', 1, 2, 1) is None
+    assert report.find_code(path, 'f', 1, 2, 100) is None
+
+def test_disassemble_extended_arg(sources):
+    path = sources.write('def f():\n    return [%s]\n' %
+                         ', '.join(str(i) for i in range(70000)))
+    code = load(path)['f'].__code__
+    offset = 0
+    while ord(code.co_code[offset]) != dis.EXTENDED_ARG:
+        offset += 3 if ord(code.co_code[offset]) >= dis.HAVE_ARGUMENT else 1
+    assert report.find_code(path, 'f', 1, 2, offset) == code
+    assert report.disassemble(code, offset) ==\
+           'LOAD_CONST %r' % code.co_consts[65536]
+    # The extended instruction isn't reported on its own.
+    assert offset + 3 not in report.decode(code)
+
+SOURCE = '''\
+def f():
+    x = 1
+    return x
+'''
+
+def frame(path, lineno, lasti):
+    return '%s\0%d\0f\0%d\0%d\0\n' % (path, lineno, 1, lasti)
+
+def sample_event(path, context, lineno, lasti):
+    return '%s%s\0\n%s\n' %\
+           (record_impl.event_header(0, 1, 2, io.SAMPLE_EVENT), context,
+            frame(path, lineno, lasti))
+
+def gc_event(path, context, duration, allocations, lineno, lasti):
+    return '%s%f\0%d\0\n%s\0\n%s\n' %\
+           (record_impl.event_header(0, 1, 2, io.GC_EVENT), duration,
+            allocations, context, frame(path, lineno, lasti))
+
+def report_lines(sources, **kwargs):
+    path = sources.write(SOURCE)
+    events = [sample_event(path, 'a', 2, 0),
+              sample_event(path, 'a', 2, 0),
+              sample_event(path, 'a', 2, 0),
+              sample_event(path, 'b', 3, 6),
+              gc_event(path, 'a', 0.5, 700, 2, 0),
+              gc_event(path, '', 0.25, 100, 3, 6)]
+    options = report.Options()
+    options.data_path = sources.write(''.join(events), '.data')
+    for name, value in kwargs.items():
+        setattr(options, name, value)
+    out = cStringIO.StringIO()
+    report.write(options, out)
+    return out.getvalue().split('\n')
+
+def test_write_instructions(sources):
+    lines = report_lines(sources, instructions=True)
+    assert lines[0] == '4 samples'
+    instructions = [line.strip('| ') for line in lines if '>>> ' in line]
+    assert instructions == ['>>> 0 LOAD_CONST 1', '>>> 6 LOAD_FAST x']
+
+    lines = report_lines(sources)
+    assert lines[0] == '4 samples'
+    assert not [line for line in lines if '>>> ' in line]
+
+def test_write_contexts(sources):
+    lines = report_lines(sources, group_by_context=True)
+    contexts = [line for line in lines if line.startswith('context ')]
+    assert contexts == ['context a: 3 samples', 'context b: 1 samples']
+
+    lines = report_lines(sources, context='b')
+    assert lines[0] == '1 samples'
+    assert ':2 in f' not in '\n'.join(lines)
+
+def test_write_gc_metrics(sources):
+    lines = report_lines(sources, metric='gc-time')
+    assert lines[0] == '0.750s in sampled gc'
+    assert '|-66% ' in '\n'.join(lines)
+
+    lines = report_lines(sources, metric='allocations')
+    assert lines[0] == '800 net container allocations at sampled collections'
+    assert '|-87% ' in '\n'.join(lines)
+
+    lines = report_lines(sources, metric='gc-time', group_by_context=True)
+    contexts = [line for line in lines if line.startswith('context ')]
+    assert contexts == ['context a: 0.500s in sampled gc',
+                        'context <none>: 0.250s in sampled gc']